@@ -1,12 +1,48 @@
+#include <algorithm>
+#include <cmath>
 #include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
 #include <iomanip>
 #include <iostream>
 #include <limits>
+#include <map>
 #include <mutex>
+#include <new>
+#include <numeric>
 #include <random>
 #include <benchmark/benchmark.h>
 #include "tree.h"
 
+/*
+ * Bytes allocated and not yet freed by the calling thread. Used to report
+ * bytes per key. The standard containers and std::make_shared release memory
+ * through sized delete, so allocations they make are tracked exactly.
+ */
+static thread_local int64_t live_bytes = 0;
+
+void* operator new(std::size_t size)
+{
+  live_bytes += size;
+  if (void* p = std::malloc(size ? size : 1)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+  std::free(p);
+}
+
+void operator delete(void* p, std::size_t size) noexcept
+{
+  live_bytes -= size;
+  std::free(p);
+}
+
+// each benchmark thread uses its own generator
 struct rng {
   rng() :
     gen(rd()),
@@ -15,70 +51,246 @@ struct rng {
   {}
 
   inline auto next() {
-    std::lock_guard<std::mutex> lk(lock);
     return dis(gen);
   }
 
+  // uniform in [0, n)
+  inline uint64_t index(uint64_t n) {
+    return next() % n;
+  }
+
+  inline double real() {
+    return std::uniform_real_distribution<double>(0.0, 1.0)(gen);
+  }
+
   std::random_device rd;
-  std::mt19937 gen;
+  std::mt19937_64 gen;
   std::uniform_int_distribution<uint64_t> dis;
-  std::mutex lock;
 };
 
-static auto buildTree(rng& r, std::size_t size)
+/*
+ * A tree of size n holds the keys keyAt(0) .. keyAt(n - 1). Keys are odd so
+ * that missKeyAt(i) falls between existing keys and is never present.
+ */
+static inline uint64_t keyAt(uint64_t i)
+{
+  return 2 * i + 1;
+}
+
+static inline uint64_t missKeyAt(uint64_t i)
+{
+  return 2 * i;
+}
+
+/*
+ * Zipfian ranks in [0, n) with rank 0 the most popular, following Gray et
+ * al., "Quickly Generating Billion-Record Synthetic Databases" (as in YCSB).
+ */
+class zipfian {
+ public:
+  zipfian(uint64_t n, double theta = 0.99) :
+    n_(n),
+    theta_(theta),
+    alpha_(1.0 / (1.0 - theta)),
+    zetan_(zeta(n, theta)),
+    eta_((1.0 - std::pow(2.0 / n, 1.0 - theta)) /
+        (1.0 - zeta(2, theta) / zetan_))
+  {}
+
+  uint64_t next(rng& r) {
+    const double u = r.real();
+    const double uz = u * zetan_;
+    if (uz < 1.0) {
+      return 0;
+    } else if (uz < 1.0 + std::pow(0.5, theta_)) {
+      return std::min<uint64_t>(1, n_ - 1);
+    }
+    const auto rank = static_cast<uint64_t>(
+        n_ * std::pow(eta_ * u - eta_ + 1.0, alpha_));
+    return std::min(rank, n_ - 1);
+  }
+
+ private:
+  // the sum is O(n), so it is computed once per size
+  static double zeta(uint64_t n, double theta) {
+    static std::mutex lock;
+    static std::map<std::pair<uint64_t, double>, double> cache;
+    std::lock_guard<std::mutex> lk(lock);
+    const auto it = cache.find(std::make_pair(n, theta));
+    if (it != cache.end()) {
+      return it->second;
+    }
+    double sum = 0;
+    for (uint64_t i = 1; i <= n; i++) {
+      sum += 1.0 / std::pow(i, theta);
+    }
+    cache.emplace(std::make_pair(n, theta), sum);
+    return sum;
+  }
+
+  const uint64_t n_;
+  const double theta_;
+  const double alpha_;
+  const double zetan_;
+  const double eta_;
+};
+
+enum distribution {
+  UNIFORM = 0,
+  ZIPFIAN = 1,
+  SEQUENTIAL = 2,
+};
+
+// indices of keys in a tree of size n, drawn from a distribution
+class keygen {
+ public:
+  keygen(int dist, uint64_t n, rng& r) :
+    dist_(dist),
+    n_(n),
+    r_(r),
+    zipf_(dist == ZIPFIAN ? n : 2),
+    seq_(r.index(n))
+  {}
+
+  uint64_t next() {
+    switch (dist_) {
+      case ZIPFIAN:
+        // scatter popular ranks across the key space
+        return scramble(zipf_.next(r_)) % n_;
+      case SEQUENTIAL:
+        seq_ = seq_ + 1 < n_ ? seq_ + 1 : 0;
+        return seq_;
+      default:
+        return r_.index(n_);
+    }
+  }
+
+ private:
+  static inline uint64_t scramble(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+  }
+
+  const int dist_;
+  const uint64_t n_;
+  rng& r_;
+  zipfian zipf_;
+  uint64_t seq_;
+};
+
+static auto buildTree(std::size_t size)
 {
+  // insert in a scattered order (a stride coprime with size) so the shape
+  // resembles a tree built from random inserts
+  uint64_t stride = 0x9e3779b97f4a7c15ULL % std::max<std::size_t>(size, 1);
+  while (std::gcd<uint64_t, uint64_t>(stride, size) != 1) {
+    stride++;
+  }
+
   Tree<uint64_t, uint64_t> tree;
-  while (tree.size() < size) {
-    const uint64_t key = r.next();
-    tree = tree.insert(key, key);
+  uint64_t i = 0;
+  for (std::size_t n = 0; n < size; n++) {
+    tree = tree.insert(keyAt(i), i);
+    i = (i + stride) % size;
   }
   return tree;
 }
 
+static auto buildMap(std::size_t size)
+{
+  std::map<uint64_t, uint64_t> map;
+  for (uint64_t i = 0; i < size; i++) {
+    map.emplace(keyAt(i), i);
+  }
+  return map;
+}
+
 static Tree<uint64_t, uint64_t> tree;
+static std::size_t tree_height = 0;
 
 static std::condition_variable cond;
-static bool init_complete = false;
 static std::mutex lock;
 
-static void BM_Insert(benchmark::State& state)
+/*
+ * The tree shared by all threads of a benchmark. It is rebuilt by the first
+ * thread when the size changes, and kept across runs of the same size.
+ */
+static const Tree<uint64_t, uint64_t>& sharedTree(benchmark::State& state,
+    std::size_t size)
 {
-  const int tree_size = state.range(0);
-  const int num_inserts = state.range(1);
-  rng r;
+  std::unique_lock<std::mutex> lk(lock);
 
   if (state.thread_index == 0) {
-    std::lock_guard<std::mutex> lk(lock);
-
-    // build the shared tree
-    if (tree.size() != tree_size) {
+    if (tree.size() != size) {
       tree.clear();
-      tree = buildTree(r, tree_size);
+      tree = buildTree(size);
+      tree_height = TreeStats::enabled ? tree.height() : 0;
     }
-
-    // notify build is complete
-    init_complete = true;
     cond.notify_all();
   }
 
   // all threads wait until the tree is built
-  std::unique_lock<std::mutex> lk(lock);
-  cond.wait(lk, [&] { return init_complete; });
-  lk.unlock();
+  cond.wait(lk, [&] { return tree.size() == size; });
+  return tree;
+}
+
+static std::map<uint64_t, uint64_t> map;
+
+// std::map baselines are single threaded
+static const std::map<uint64_t, uint64_t>& sharedMap(std::size_t size)
+{
+  if (map.size() != size) {
+    map.clear();
+    map = buildMap(size);
+  }
+  return map;
+}
+
+/*
+ * Report this thread's tree operation counters per item processed, and the
+ * shape of the shared tree, when tree.h is built with TREE_STATS.
+ */
+static void reportTreeStats(benchmark::State& state,
+    const TreeStats::counts_type& before, std::size_t items)
+{
+  if (!TreeStats::enabled || items == 0) {
+    return;
+  }
+
+  const auto after = TreeStats::thread();
+  for (int i = 0; i < TreeStats::NUM_COUNTERS; i++) {
+    const auto counter = static_cast<TreeStats::Counter>(i);
+    state.counters[TreeStats::name(counter)] = benchmark::Counter(
+        static_cast<double>(after[i] - before[i]) / items,
+        benchmark::Counter::kAvgThreads);
+  }
+
+  state.counters["height"] = benchmark::Counter(tree_height,
+      benchmark::Counter::kAvgThreads);
+  state.counters["black_height"] = benchmark::Counter(tree.blackHeight(),
+      benchmark::Counter::kAvgThreads);
+}
+
+static void BM_Insert(benchmark::State& state)
+{
+  const std::size_t tree_size = state.range(0);
+  const int num_inserts = state.range(1);
+  rng r;
 
-  assert(tree_size > 0);
-  assert(tree.size() == tree_size);
+  const auto& tree = sharedTree(state, tree_size);
 
   // generate set of keys to insert
   std::vector<uint64_t> keys;
   keys.reserve(num_inserts);
   while (keys.size() < num_inserts) {
-    const auto key = r.next();
-    if (!tree.get(key)) {
-      keys.emplace_back(key);
-    }
+    keys.emplace_back(missKeyAt(r.index(tree_size + 1)));
   }
 
+  const auto stats = TreeStats::thread();
   for (auto _ : state) {
     for (const auto& key : keys) {
       benchmark::DoNotOptimize(tree.insert(key, key));
@@ -86,18 +298,591 @@ static void BM_Insert(benchmark::State& state)
   }
 
   state.SetItemsProcessed(state.iterations() * keys.size());
+  reportTreeStats(state, stats, state.iterations() * keys.size());
+}
 
-  if (state.thread_index == 0) {
-    // tree is cleared when the size changes in the initialization phase. Note
-    // that if there are more benchmarks in this executable, we might want to
-    // figure out a way to clear the tree after the very last run.
+static void BM_Get(benchmark::State& state)
+{
+  const std::size_t tree_size = state.range(0);
+  const bool hit = state.range(1);
+  const int dist = state.range(2);
+  rng r;
+  keygen gen(dist, tree_size, r);
+
+  const auto& tree = sharedTree(state, tree_size);
+
+  std::vector<uint64_t> keys(10000);
+  for (auto& key : keys) {
+    const auto i = gen.next();
+    key = hit ? keyAt(i) : missKeyAt(i);
+  }
+
+  for (auto _ : state) {
+    for (const auto& key : keys) {
+      benchmark::DoNotOptimize(tree.get(key));
+    }
+  }
+
+  state.SetItemsProcessed(state.iterations() * keys.size());
+}
+
+static void BM_Remove(benchmark::State& state)
+{
+  const std::size_t tree_size = state.range(0);
+  rng r;
+
+  const auto& tree = sharedTree(state, tree_size);
+
+  std::vector<uint64_t> keys(10000);
+  for (auto& key : keys) {
+    key = keyAt(r.index(tree_size));
+  }
+
+  const auto stats = TreeStats::thread();
+  for (auto _ : state) {
+    for (const auto& key : keys) {
+      benchmark::DoNotOptimize(tree.remove(key));
+    }
+  }
+
+  state.SetItemsProcessed(state.iterations() * keys.size());
+  reportTreeStats(state, stats, state.iterations() * keys.size());
+}
+
+static void BM_Scan(benchmark::State& state)
+{
+  const std::size_t tree_size = state.range(0);
+
+  const auto& tree = sharedTree(state, tree_size);
+
+  for (auto _ : state) {
+    uint64_t sum = 0;
+    tree.forEach([&](const uint64_t& key, const uint64_t&) {
+      sum += key;
+    });
+    benchmark::DoNotOptimize(sum);
+  }
+
+  state.SetItemsProcessed(state.iterations() * tree_size);
+}
+
+static void BM_RangeScan(benchmark::State& state)
+{
+  const std::size_t tree_size = state.range(0);
+  const std::size_t span = state.range(1);
+  rng r;
+
+  const auto& tree = sharedTree(state, tree_size);
+
+  std::vector<uint64_t> starts(1000);
+  for (auto& start : starts) {
+    start = r.index(tree_size);
+  }
+
+  std::size_t items = 0;
+  for (auto _ : state) {
+    for (const auto& start : starts) {
+      tree.forEach(keyAt(start), keyAt(start + span),
+          [&](const uint64_t&, const uint64_t&) {
+            items++;
+          });
+    }
+  }
+
+  state.SetItemsProcessed(items);
+}
+
+/*
+ * Each thread starts from the shared tree and applies a mix of updates to
+ * existing keys and lookups to its own version.
+ */
+static void BM_Mixed(benchmark::State& state)
+{
+  const std::size_t tree_size = state.range(0);
+  const int write_pct = state.range(1);
+  const int dist = state.range(2);
+  rng r;
+  keygen gen(dist, tree_size, r);
+
+  auto local = sharedTree(state, tree_size);
+
+  std::vector<std::pair<uint64_t, bool>> ops(10000);
+  for (auto& op : ops) {
+    op.first = keyAt(gen.next());
+    op.second = r.index(100) < write_pct;
+  }
+
+  const auto stats = TreeStats::thread();
+  for (auto _ : state) {
+    for (const auto& op : ops) {
+      if (op.second) {
+        local = local.insert(op.first, op.first);
+      } else {
+        benchmark::DoNotOptimize(local.get(op.first));
+      }
+    }
+  }
+
+  state.SetItemsProcessed(state.iterations() * ops.size());
+  reportTreeStats(state, stats, state.iterations() * ops.size());
+}
+
+/*
+ * Updates while retaining the most recent snapshots. Every update path copies
+ * nodes, and evicting a snapshot frees the nodes no other snapshot shares.
+ */
+static void BM_SnapshotChurn(benchmark::State& state)
+{
+  const std::size_t tree_size = state.range(0);
+  const std::size_t retained = state.range(1);
+  rng r;
+
+  auto local = sharedTree(state, tree_size);
+  std::vector<Tree<uint64_t, uint64_t>> snapshots(retained);
+  std::size_t next = 0;
+
+  std::vector<uint64_t> keys(10000);
+  for (auto& key : keys) {
+    key = keyAt(r.index(tree_size));
+  }
+
+  const auto stats = TreeStats::thread();
+  for (auto _ : state) {
+    for (const auto& key : keys) {
+      local = local.insert(key, key);
+      snapshots[next] = local;
+      next = next + 1 < retained ? next + 1 : 0;
+    }
+  }
+
+  state.SetItemsProcessed(state.iterations() * keys.size());
+  reportTreeStats(state, stats, state.iterations() * keys.size());
+}
+
+// cost of releasing the last reference to a tree
+static void BM_Teardown(benchmark::State& state)
+{
+  const std::size_t tree_size = state.range(0);
+
+  for (auto _ : state) {
+    state.PauseTiming();
+    auto tree = buildTree(tree_size);
+    state.ResumeTiming();
+    tree.clear();
+  }
+
+  state.SetItemsProcessed(state.iterations() * tree_size);
+}
+
+static void BM_Memory(benchmark::State& state)
+{
+  const std::size_t tree_size = state.range(0);
+
+  for (auto _ : state) {
+    const auto before = live_bytes;
+    auto tree = buildTree(tree_size);
+    state.counters["bytes_per_key"] =
+      static_cast<double>(live_bytes - before) / tree_size;
+    state.PauseTiming();
+    tree.clear();
+    state.ResumeTiming();
+  }
+
+  state.SetItemsProcessed(state.iterations() * tree_size);
+}
+
+static void BM_MapMemory(benchmark::State& state)
+{
+  const std::size_t map_size = state.range(0);
+
+  for (auto _ : state) {
+    const auto before = live_bytes;
+    auto map = buildMap(map_size);
+    state.counters["bytes_per_key"] =
+      static_cast<double>(live_bytes - before) / map_size;
+    state.PauseTiming();
+    map.clear();
+    state.ResumeTiming();
+  }
+
+  state.SetItemsProcessed(state.iterations() * map_size);
+}
+
+static void BM_MapGet(benchmark::State& state)
+{
+  const std::size_t map_size = state.range(0);
+  const int dist = state.range(1);
+  rng r;
+  keygen gen(dist, map_size, r);
+
+  const auto& map = sharedMap(map_size);
+
+  std::vector<uint64_t> keys(10000);
+  for (auto& key : keys) {
+    key = keyAt(gen.next());
+  }
+
+  for (auto _ : state) {
+    for (const auto& key : keys) {
+      benchmark::DoNotOptimize(map.find(key));
+    }
   }
+
+  state.SetItemsProcessed(state.iterations() * keys.size());
 }
 
+// in-place inserts into a mutable std::map
+static void BM_MapInsert(benchmark::State& state)
+{
+  const std::size_t map_size = state.range(0);
+  const int num_inserts = state.range(1);
+  rng r;
+
+  auto local = sharedMap(map_size);
+
+  std::vector<uint64_t> keys;
+  keys.reserve(num_inserts);
+  while (keys.size() < num_inserts) {
+    keys.emplace_back(missKeyAt(r.index(map_size + 1)));
+  }
+
+  for (auto _ : state) {
+    for (const auto& key : keys) {
+      benchmark::DoNotOptimize(local.emplace(key, key));
+    }
+    state.PauseTiming();
+    for (const auto& key : keys) {
+      local.erase(key);
+    }
+    state.ResumeTiming();
+  }
+
+  state.SetItemsProcessed(state.iterations() * keys.size());
+}
+
+// persistence by copying: every insert produces a new std::map
+static void BM_MapCopyInsert(benchmark::State& state)
+{
+  const std::size_t map_size = state.range(0);
+  rng r;
+
+  const auto& map = sharedMap(map_size);
+
+  std::vector<uint64_t> keys(100);
+  for (auto& key : keys) {
+    key = missKeyAt(r.index(map_size + 1));
+  }
+
+  for (auto _ : state) {
+    for (const auto& key : keys) {
+      auto copy = map;
+      copy.emplace(key, key);
+      benchmark::DoNotOptimize(copy);
+    }
+  }
+
+  state.SetItemsProcessed(state.iterations() * keys.size());
+}
+
+// the configuration of the tables in README.md
 BENCHMARK(BM_Insert)
   ->RangeMultiplier(10)
-  ->Ranges({{1, 1000}, {10000, 10000}})
-  ->ThreadRange(1, 4)
+  ->Ranges({{1, 100000000}, {50000, 50000}})
+  ->ThreadRange(1, 16)
+  ->Threads(20)
   ->UseRealTime();
 
+// tree size x hit x distribution
+static void getArgs(benchmark::internal::Benchmark* b)
+{
+  for (const int tree_size : {10000, 1000000, 10000000}) {
+    for (const int hit : {1, 0}) {
+      for (const int dist : {UNIFORM, ZIPFIAN, SEQUENTIAL}) {
+        b->Args({tree_size, hit, dist});
+      }
+    }
+  }
+}
+
+BENCHMARK(BM_Get)
+  ->Apply(getArgs)
+  ->ThreadRange(1, 8)
+  ->UseRealTime();
+
+BENCHMARK(BM_Remove)
+  ->RangeMultiplier(10)
+  ->Range(10000, 10000000)
+  ->ThreadRange(1, 8)
+  ->UseRealTime();
+
+BENCHMARK(BM_Scan)
+  ->RangeMultiplier(10)
+  ->Range(10000, 10000000);
+
+BENCHMARK(BM_RangeScan)
+  ->RangeMultiplier(10)
+  ->Ranges({{10000, 10000000}, {10, 1000}});
+
+// tree size x write percentage x distribution
+static void mixedArgs(benchmark::internal::Benchmark* b)
+{
+  for (const int tree_size : {1000000, 10000000}) {
+    for (const int write_pct : {0, 5, 50, 100}) {
+      for (const int dist : {UNIFORM, ZIPFIAN, SEQUENTIAL}) {
+        b->Args({tree_size, write_pct, dist});
+      }
+    }
+  }
+}
+
+BENCHMARK(BM_Mixed)
+  ->Apply(mixedArgs)
+  ->ThreadRange(1, 8)
+  ->UseRealTime();
+
+BENCHMARK(BM_SnapshotChurn)
+  ->RangeMultiplier(32)
+  ->Ranges({{1000000, 1000000}, {1, 1024}});
+
+BENCHMARK(BM_Teardown)
+  ->RangeMultiplier(10)
+  ->Range(10000, 1000000)
+  ->Unit(benchmark::kMillisecond);
+
+BENCHMARK(BM_Memory)
+  ->RangeMultiplier(100)
+  ->Range(10000, 1000000)
+  ->Iterations(1)
+  ->Unit(benchmark::kMillisecond);
+
+BENCHMARK(BM_MapMemory)
+  ->RangeMultiplier(100)
+  ->Range(10000, 1000000)
+  ->Iterations(1)
+  ->Unit(benchmark::kMillisecond);
+
+// map size x distribution
+static void mapGetArgs(benchmark::internal::Benchmark* b)
+{
+  for (const int map_size : {10000, 1000000, 10000000}) {
+    for (const int dist : {UNIFORM, ZIPFIAN, SEQUENTIAL}) {
+      b->Args({map_size, dist});
+    }
+  }
+}
+
+BENCHMARK(BM_MapGet)->Apply(mapGetArgs);
+
+BENCHMARK(BM_MapInsert)
+  ->RangeMultiplier(10)
+  ->Ranges({{10000, 10000000}, {50000, 50000}});
+
+BENCHMARK(BM_MapCopyInsert)
+  ->RangeMultiplier(10)
+  ->Range(1000, 100000);
+
+// unsorted input for bulk builds, with some repeated keys
+static auto buildInput(std::size_t size)
+{
+  rng r;
+  std::vector<std::pair<uint64_t, uint64_t>> input(size);
+  for (auto& item : input) {
+    item.first = keyAt(r.index(size));
+    item.second = r.next();
+  }
+  return input;
+}
+
+static void BM_Build(benchmark::State& state)
+{
+  const std::size_t size = state.range(0);
+  const unsigned threads = state.range(1);
+  const auto input = buildInput(size);
+
+  for (auto _ : state) {
+    auto tree = Tree<uint64_t, uint64_t>::build(input.begin(), input.end(),
+        threads);
+    benchmark::DoNotOptimize(tree);
+    state.PauseTiming();
+    tree.clear();
+    state.ResumeTiming();
+  }
+
+  state.SetItemsProcessed(state.iterations() * size);
+}
+
+// the serial path: one insert per input item
+static void BM_BuildSerial(benchmark::State& state)
+{
+  const std::size_t size = state.range(0);
+  const auto input = buildInput(size);
+
+  for (auto _ : state) {
+    Tree<uint64_t, uint64_t> tree;
+    for (const auto& item : input) {
+      tree = tree.insert(item.first, item.second);
+    }
+    benchmark::DoNotOptimize(tree);
+    state.PauseTiming();
+    tree.clear();
+    state.ResumeTiming();
+  }
+
+  state.SetItemsProcessed(state.iterations() * size);
+}
+
+// input size x threads
+static void buildArgs(benchmark::internal::Benchmark* b)
+{
+  for (const int size : {1000000, 10000000, 100000000}) {
+    for (const int threads : {1, 4, 16}) {
+      b->Args({size, threads});
+    }
+  }
+}
+
+BENCHMARK(BM_Build)
+  ->Apply(buildArgs)
+  ->Unit(benchmark::kMillisecond)
+  ->UseRealTime();
+
+BENCHMARK(BM_BuildSerial)
+  ->RangeMultiplier(10)
+  ->Range(1000000, 100000000)
+  ->Unit(benchmark::kMillisecond)
+  ->UseRealTime();
+
+static AtomicTree<uint64_t, uint64_t> head;
+
+static Tree<uint64_t, uint64_t> locked_tree;
+static std::mutex locked_tree_lock;
+
+static void setupWriters(benchmark::State& state)
+{
+  const auto& tree = sharedTree(state, state.range(0));
+
+  // publish the shared tree to the writers
+  if (state.thread_index == 0) {
+    std::lock_guard<std::mutex> lk(lock);
+    head.store(tree);
+    locked_tree = tree;
+  }
+}
+
+// each writer updates its own disjoint set of keys
+static auto writerKeys(benchmark::State& state, rng& r)
+{
+  const int batch_size = state.range(1);
+  std::vector<uint64_t> keys;
+  keys.reserve(batch_size);
+  while (keys.size() < batch_size) {
+    keys.emplace_back((r.next() << 8) | state.thread_index);
+  }
+  return keys;
+}
+
+static void BM_Commit(benchmark::State& state)
+{
+  rng r;
+  setupWriters(state);
+  const auto keys = writerKeys(state, r);
+
+  const auto stats = TreeStats::thread();
+  for (auto _ : state) {
+    auto txn = head.begin();
+    for (const auto& key : keys) {
+      txn.insert(key, key);
+    }
+    benchmark::DoNotOptimize(head.commit(txn));
+  }
+
+  state.SetItemsProcessed(state.iterations() * keys.size());
+  reportTreeStats(state, stats, state.iterations() * keys.size());
+}
+
+static void BM_CommitLocked(benchmark::State& state)
+{
+  rng r;
+  setupWriters(state);
+  const auto keys = writerKeys(state, r);
+
+  for (auto _ : state) {
+    std::lock_guard<std::mutex> lk(locked_tree_lock);
+    for (const auto& key : keys) {
+      locked_tree = locked_tree.insert(key, key);
+    }
+  }
+
+  state.SetItemsProcessed(state.iterations() * keys.size());
+}
+
+BENCHMARK(BM_Commit)
+  ->RangeMultiplier(10)
+  ->Ranges({{10000, 1000000}, {10, 1000}})
+  ->ThreadRange(1, 8)
+  ->UseRealTime();
+
+BENCHMARK(BM_CommitLocked)
+  ->RangeMultiplier(10)
+  ->Ranges({{10000, 1000000}, {10, 1000}})
+  ->ThreadRange(1, 8)
+  ->UseRealTime();
+
+// std::string without the inline key prefix, for comparison
+struct PlainString : std::string {
+  using std::string::string;
+};
+
+// long keys with a common prefix of the requested length, followed by a
+// random 16 digit id and a common suffix
+template<typename Key>
+static Key makeStringKey(rng& r, const std::string& common)
+{
+  char id[17];
+  std::snprintf(id, sizeof(id), "%016llx",
+      static_cast<unsigned long long>(r.next()));
+  return Key((common + id + "/profile").c_str());
+}
+
+template<typename Key>
+static void BM_StringGet(benchmark::State& state)
+{
+  const std::size_t tree_size = state.range(0);
+  const std::string common(state.range(1), 'k');
+  rng r;
+
+  std::vector<Key> keys;
+  Tree<Key, Key> t;
+  while (t.size() < tree_size) {
+    const auto key = makeStringKey<Key>(r, common);
+    t = t.insert(key, key);
+    keys.emplace_back(key);
+  }
+
+  // look up copies of a random sample so the keys don't share memory
+  std::shuffle(keys.begin(), keys.end(), r.gen);
+  keys.resize(std::min<std::size_t>(keys.size(), 10000));
+
+  for (auto _ : state) {
+    for (const auto& key : keys) {
+      benchmark::DoNotOptimize(t.get(key));
+    }
+  }
+
+  state.SetItemsProcessed(state.iterations() * keys.size());
+}
+
+// tree size x length of the common key prefix
+static void stringKeyArgs(benchmark::internal::Benchmark* b)
+{
+  for (const int tree_size : {10000, 1000000}) {
+    for (const int common : {0, 4, 16}) {
+      b->Args({tree_size, common});
+    }
+  }
+}
+
+BENCHMARK_TEMPLATE(BM_StringGet, std::string)->Apply(stringKeyArgs);
+BENCHMARK_TEMPLATE(BM_StringGet, PlainString)->Apply(stringKeyArgs);
+
 BENCHMARK_MAIN();
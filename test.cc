@@ -5,6 +5,8 @@
 #include <list>
 #include <iomanip>
 #include <random>
+#include <thread>
+#include <vector>
 
 struct tree_pair {
   Tree<std::string, std::string> tree;
@@ -56,10 +58,317 @@ static void verify_history(uint32_t coin_toss)
   }
 }
 
+// string keys sharing long prefixes, embedded zeros and high bytes exercise
+// both the inline prefix comparison and the full key fallback
+static void verify_string_keys()
+{
+  std::random_device rd;
+  std::mt19937 gen(rd());
+  std::uniform_int_distribution<uint32_t> len(0, 12);
+  std::uniform_int_distribution<uint32_t> byte(0, 3);
+  const char bytes[] = {'\0', 'a', 'b', '\xff'};
+
+  Tree<std::string, std::string> tree;
+  std::map<std::string, std::string> truth;
+
+  for (int i = 0; i < 20000; i++) {
+    std::string key(len(gen), 'a');
+    for (auto& c : key) {
+      c = bytes[byte(gen)];
+    }
+    if (i % 3) {
+      tree = tree.insert(key, key);
+      truth[key] = key;
+    } else {
+      tree = tree.remove(key);
+      truth.erase(key);
+    }
+    assert(bool(tree.get(key)) == (truth.count(key) == 1));
+  }
+
+  assert(tree.items() == truth);
+  assert(tree.size() == truth.size());
+  assert(tree.consistent());
+}
+
+static void verify_scan()
+{
+  std::random_device rd;
+  std::mt19937 gen(rd());
+  std::uniform_int_distribution<uint32_t> dis(0, 20000);
+
+  Tree<std::string, std::string> tree;
+  for (int i = 0; i < 5000; i++) {
+    const std::string key = tostr(dis(gen));
+    tree = tree.insert(key, key);
+  }
+  const auto truth = tree.items();
+
+  std::map<std::string, std::string> all;
+  tree.forEach([&](const auto& key, const auto& value) {
+    assert(all.empty() || all.rbegin()->first < key);
+    all.emplace(key, value);
+  });
+  assert(all == truth);
+
+  for (int i = 0; i < 1000; i++) {
+    auto lo = tostr(dis(gen));
+    auto hi = tostr(dis(gen));
+    if (hi < lo) {
+      std::swap(lo, hi);
+    }
+
+    std::map<std::string, std::string> range;
+    tree.forEach(lo, hi, [&](const auto& key, const auto& value) {
+      assert(range.empty() || range.rbegin()->first < key);
+      range.emplace(key, value);
+    });
+    const std::map<std::string, std::string> expected(
+        truth.lower_bound(lo), truth.lower_bound(hi));
+    assert(range == expected);
+  }
+}
+
+static void verify_stats()
+{
+  const auto before = TreeStats::thread();
+
+  {
+    Tree<std::string, std::string> tree;
+    for (uint32_t i = 0; i < 1000; i++) {
+      tree = tree.insert(tostr(i), tostr(i));
+    }
+    assert(tree.blackHeight() > 0);
+    assert(tree.height() >= tree.blackHeight());
+    assert(tree.height() <= 2 * tree.blackHeight());
+
+    // a single insert copies one path and shares everything else
+    const auto next = tree.insert(tostr(5000), tostr(5000));
+    const auto sharing = next.sharing(tree);
+    assert(sharing.unique + sharing.shared == next.size());
+    assert(sharing.unique > 0);
+    assert(sharing.unique <= next.height() + 2);
+    assert(tree.sharing(tree).unique == 0);
+    assert(tree.sharing(Tree<std::string, std::string>()).shared == 0);
+
+    tree = tree.remove(tostr(0));
+  }
+
+  if (TreeStats::enabled) {
+    auto after = TreeStats::thread();
+    for (std::size_t i = 0; i < after.size(); i++) {
+      after[i] -= before[i];
+    }
+    assert(after[TreeStats::INSERTS] == 1001);
+    assert(after[TreeStats::REMOVES] == 1);
+    assert(after[TreeStats::NODES_ALLOCATED] ==
+        after[TreeStats::INSERT_NODES_ALLOCATED] +
+        after[TreeStats::REMOVE_NODES_ALLOCATED]);
+    assert(after[TreeStats::NODES_ALLOCATED] ==
+        after[TreeStats::NODES_FREED]);
+    assert(after[TreeStats::BALANCE_RR] > 0);
+
+    const auto total = TreeStats::collect();
+    for (std::size_t i = 0; i < total.size(); i++) {
+      assert(total[i] >= after[i]);
+    }
+  }
+}
+
+static void verify_build()
+{
+  std::random_device rd;
+  std::mt19937 gen(rd());
+  std::uniform_int_distribution<uint32_t> dis(0, 500000);
+
+  // large inputs are split across threads, small ones use fewer threads
+  for (const unsigned threads : {1, 2, 3, 8, 1024}) {
+    for (const std::size_t size : {0, 1, 2, 3, 7, 8, 1000, 300000}) {
+      // duplicate keys take the value that appears last
+      std::vector<std::pair<std::string, std::string>> input;
+      std::map<std::string, std::string> truth;
+      for (std::size_t i = 0; i < size; i++) {
+        const auto key = tostr(dis(gen));
+        const auto value = tostr(i);
+        input.emplace_back(key, value);
+        truth[key] = value;
+      }
+
+      const auto tree = Tree<std::string, std::string>::build(
+          input.begin(), input.end(), threads);
+      assert(tree.items() == truth);
+      assert(tree.size() == truth.size());
+      assert(tree.consistent());
+
+      // the result is an ordinary tree
+      const auto next = tree.insert(tostr(50000), tostr(50000))
+        .remove(input.empty() ? tostr(0) : input.front().first);
+      assert(next.consistent());
+    }
+  }
+}
+
+// holds nodes until static destruction, after main's counters are retired
+static Tree<std::string, std::string> exit_tree;
+
+static void verify_stats_retired()
+{
+  for (uint32_t i = 0; i < 100; i++) {
+    exit_tree = exit_tree.insert(tostr(i), tostr(i));
+  }
+
+  const auto before = TreeStats::collect();
+
+  // the thread_local tree is constructed before the thread's counters, so
+  // it is destroyed, freeing its nodes, after the counters are retired
+  std::thread([] {
+    static thread_local Tree<std::string, std::string> tree;
+    for (uint32_t i = 0; i < 100; i++) {
+      tree = tree.insert(tostr(i), tostr(i));
+    }
+  }).join();
+
+  if (TreeStats::enabled) {
+    const auto after = TreeStats::collect();
+    const auto allocated = after[TreeStats::NODES_ALLOCATED] -
+      before[TreeStats::NODES_ALLOCATED];
+    const auto freed = after[TreeStats::NODES_FREED] -
+      before[TreeStats::NODES_FREED];
+    assert(allocated > 0);
+    assert(allocated == freed);
+  }
+}
+
+static void verify_merge(uint32_t coin_toss)
+{
+  std::random_device rd;
+  std::mt19937 gen(rd());
+  std::uniform_int_distribution<uint32_t> dis(0, 5000);
+  std::uniform_int_distribution<uint32_t> coin(0, 100);
+
+  Tree<std::string, std::string> base;
+  for (int i = 0; i < 2000; i++) {
+    const std::string key = tostr(dis(gen));
+    base = base.insert(key, key);
+  }
+
+  // apply random updates to a copy of base, tracking them in a map
+  auto update = [&](const std::string& tag, auto& changes) {
+    auto tree = base;
+    for (int i = 0; i < 200; i++) {
+      const std::string key = tostr(dis(gen));
+      if (coin(gen) < coin_toss) {
+        tree = tree.insert(key, key + tag);
+        changes[key] = key + tag;
+      } else {
+        tree = tree.remove(key);
+        changes[key] = boost::none;
+      }
+    }
+    return tree;
+  };
+
+  std::map<std::string, boost::optional<std::string>> ours_changes;
+  std::map<std::string, boost::optional<std::string>> theirs_changes;
+  const auto ours = update("o", ours_changes);
+  const auto theirs = update("t", theirs_changes);
+
+  // diff reports exactly the keys whose values changed
+  std::map<std::string, boost::optional<std::string>> diffed;
+  Tree<std::string, std::string>::diff(base, ours,
+      [&](const auto& key, const auto& from, const auto& to) {
+        const auto before = base.get(key);
+        assert(from != to);
+        assert(bool(from) == bool(before));
+        assert(!from || *from == before->second);
+        diffed[key] = to;
+      });
+  for (const auto& change : ours_changes) {
+    const auto before = base.get(change.first);
+    const bool changed = before ?
+      before->second != change.second : bool(change.second);
+    assert(changed == (diffed.count(change.first) == 1));
+    if (changed) {
+      assert(diffed[change.first] == change.second);
+    }
+  }
+  for (const auto& change : diffed) {
+    assert(ours_changes.count(change.first) == 1);
+  }
+
+  // merged state: theirs changes, then ours effective changes win conflicts
+  auto truth = base.items();
+  for (const auto& changes : {theirs_changes, diffed}) {
+    for (const auto& change : changes) {
+      if (change.second) {
+        truth[change.first] = *change.second;
+      } else {
+        truth.erase(change.first);
+      }
+    }
+  }
+
+  const auto merged = Tree<std::string, std::string>::merge(base, ours, theirs,
+      Tree<std::string, std::string>::PreferOurs());
+  assert(merged.items() == truth);
+  assert(merged.size() == truth.size());
+  assert(merged.consistent());
+}
+
+static void verify_commit()
+{
+  const int num_threads = 4;
+  const int num_txns = 200;
+  AtomicTree<std::string, std::string> head;
+
+  // writers update disjoint keys, so every commit must be preserved
+  std::vector<std::thread> threads;
+  for (int t = 0; t < num_threads; t++) {
+    threads.emplace_back([&, t] {
+      for (int i = 0; i < num_txns; i++) {
+        auto txn = head.begin();
+        for (int j = 0; j < 10; j++) {
+          const auto key = tostr((i * 10 + j) * num_threads + t);
+          txn.insert(key, key);
+        }
+        if (i > 0) {
+          txn.remove(tostr(((i - 1) * 10) * num_threads + t));
+        }
+        head.commit(txn);
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  const auto tree = head.load();
+  assert(tree.size() == num_threads * (num_txns * 10 - (num_txns - 1)));
+  assert(tree.consistent());
+  for (int t = 0; t < num_threads; t++) {
+    for (int i = 0; i < num_txns; i++) {
+      for (int j = 0; j < 10; j++) {
+        const auto key = tostr((i * 10 + j) * num_threads + t);
+        assert(bool(tree.get(key)) == (j != 0 || i == num_txns - 1));
+      }
+    }
+  }
+}
+
 int main()
 {
   verify_history(25);
   verify_history(50);
   verify_history(75);
   verify_history(100);
+
+  verify_string_keys();
+  verify_scan();
+  verify_stats();
+  verify_stats_retired();
+  verify_build();
+
+  verify_merge(25);
+  verify_merge(75);
+  verify_commit();
 }
@@ -4,14 +4,259 @@
  */
 #pragma once
 #include <map>
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <cassert>
+#include <cstdint>
+#include <future>
 #include <memory>
+#include <mutex>
 #include <stack>
 #include <string>
+#include <thread>
 #include <utility>
+#include <vector>
 #include <cstddef>
 #include <boost/optional.hpp>
 
+/*
+ * Hot path counters for tree operations, enabled by defining TREE_STATS.
+ * When disabled every counter update compiles away.
+ *
+ * Each thread updates its own counters without synchronization. thread()
+ * reads the calling thread's counters and collect() sums over all threads,
+ * including threads that have exited. Nodes freed by a thread after its
+ * counters were retired (e.g. by a static Tree destroyed at exit) are counted
+ * directly in the retired totals.
+ */
+class TreeStats {
+ public:
+  enum Counter {
+    NODES_ALLOCATED,
+    NODES_FREED,
+    INSERTS,
+    INSERT_NODES_ALLOCATED,
+    REMOVES,
+    REMOVE_NODES_ALLOCATED,
+    // balance() cases, named by the red child and red grandchild
+    BALANCE_LL,
+    BALANCE_LR,
+    BALANCE_RL,
+    BALANCE_RR,
+    // fuse() cases, named by the colors of the left and right subtrees
+    FUSE_BR,
+    FUSE_RB,
+    FUSE_RR,
+    FUSE_BB,
+    NUM_COUNTERS
+  };
+
+  typedef std::array<std::uint64_t, NUM_COUNTERS> counts_type;
+
+#ifdef TREE_STATS
+  static constexpr bool enabled = true;
+#else
+  static constexpr bool enabled = false;
+#endif
+
+  static const char *name(const Counter counter) {
+    static const char *names[NUM_COUNTERS] = {
+      "nodes_allocated",
+      "nodes_freed",
+      "inserts",
+      "insert_nodes_allocated",
+      "removes",
+      "remove_nodes_allocated",
+      "balance_ll",
+      "balance_lr",
+      "balance_rl",
+      "balance_rr",
+      "fuse_br",
+      "fuse_rb",
+      "fuse_rr",
+      "fuse_bb",
+    };
+    return names[counter];
+  }
+
+  static inline void inc(const Counter counter, const std::uint64_t n = 1) {
+#ifdef TREE_STATS
+    auto& l = local();
+    if (l.retired) {
+      std::lock_guard<std::mutex> lk(lock());
+      retired()[counter] += n;
+      return;
+    }
+    // only the owning thread writes, so a plain load and store suffices
+    auto& value = l.counts[counter];
+    value.store(value.load(std::memory_order_relaxed) + n,
+        std::memory_order_relaxed);
+#else
+    (void)counter;
+    (void)n;
+#endif
+  }
+
+  static counts_type thread() {
+    counts_type out{};
+#ifdef TREE_STATS
+    local().addTo(out);
+#endif
+    return out;
+  }
+
+  static counts_type collect() {
+    counts_type out{};
+#ifdef TREE_STATS
+    std::lock_guard<std::mutex> lk(lock());
+    out = retired();
+    for (const auto l : registry()) {
+      l->addTo(out);
+    }
+#endif
+    return out;
+  }
+
+  /*
+   * Attributes the nodes allocated while in scope to an operation.
+   */
+  class Scope {
+   public:
+#ifdef TREE_STATS
+    Scope(const Counter op, const Counter allocated) :
+      allocated_(allocated),
+      start_(local().counts[NODES_ALLOCATED].load(std::memory_order_relaxed))
+    {
+      inc(op);
+    }
+
+    ~Scope() {
+      inc(allocated_,
+          local().counts[NODES_ALLOCATED].load(std::memory_order_relaxed) -
+          start_);
+    }
+
+   private:
+    const Counter allocated_;
+    const std::uint64_t start_;
+#else
+    Scope(const Counter, const Counter) {}
+#endif
+  };
+
+#ifdef TREE_STATS
+ private:
+  // trivially destructible, so it stays usable after the thread's Guard ran
+  struct Local {
+    void addTo(counts_type& out) const {
+      for (std::size_t i = 0; i < NUM_COUNTERS; i++) {
+        out[i] += counts[i].load(std::memory_order_relaxed);
+      }
+    }
+
+    std::atomic<std::uint64_t> counts[NUM_COUNTERS];
+    bool retired;
+  };
+
+  // registers a thread's counters, and retires them when the thread exits
+  struct Guard {
+    explicit Guard(Local *l) :
+      l(l)
+    {
+      std::lock_guard<std::mutex> lk(lock());
+      registry().push_back(l);
+    }
+
+    ~Guard() {
+      std::lock_guard<std::mutex> lk(lock());
+      l->addTo(retired());
+      l->retired = true;
+      auto& r = registry();
+      r.erase(std::find(r.begin(), r.end(), l));
+    }
+
+    Local *l;
+  };
+
+  static Local& local() {
+    static thread_local Local l{};
+    static thread_local Guard guard(&l);
+    return l;
+  }
+
+  // never destroyed, since nodes may be freed during static destruction
+  static std::mutex& lock() {
+    static auto m = new std::mutex;
+    return *m;
+  }
+
+  static std::vector<Local*>& registry() {
+    static auto r = new std::vector<Local*>;
+    return *r;
+  }
+
+  static counts_type& retired() {
+    static auto r = new counts_type{};
+    return *r;
+  }
+#endif
+};
+
+/*
+ * Order-preserving key prefix stored inline in each tree node. Searches
+ * compare prefixes first and only fall back to the full key in the node's
+ * entry when the prefixes tie. The default prefix carries no information and
+ * always ties.
+ */
+template<typename Key>
+class KeyPrefix {
+ public:
+  explicit KeyPrefix(const Key&) {}
+
+  int compare(const KeyPrefix&) const {
+    return 0;
+  }
+};
+
+/*
+ * The first 8 bytes of a string key as a big-endian integer, zero padded.
+ * std::string compares bytes as unsigned char, so integer order matches key
+ * order whenever the prefixes differ.
+ */
+template<>
+class KeyPrefix<std::string> {
+ public:
+  explicit KeyPrefix(const std::string& key) :
+    prefix_(load(key))
+  {}
+
+  int compare(const KeyPrefix& other) const {
+    if (prefix_ < other.prefix_) {
+      return -1;
+    } else if (prefix_ > other.prefix_) {
+      return 1;
+    } else {
+      return 0;
+    }
+  }
+
+ private:
+  static std::uint64_t load(const std::string& key) {
+    const auto len = std::min(key.size(), sizeof(std::uint64_t));
+    std::uint64_t prefix = 0;
+    for (std::size_t i = 0; i < sizeof(std::uint64_t); i++) {
+      prefix <<= 8;
+      if (i < len) {
+        prefix |= static_cast<unsigned char>(key[i]);
+      }
+    }
+    return prefix;
+  }
+
+  std::uint64_t prefix_;
+};
+
 template<
   typename Key,
   typename T>
@@ -26,6 +271,7 @@ class Tree {
   typedef Key key_type;
   typedef T   mapped_type;
   typedef std::pair<Key, T> value_type;
+  typedef KeyPrefix<Key> prefix_type;
 
   struct Entry {
     Entry(const key_type& key, const mapped_type& value) :
@@ -33,26 +279,55 @@ class Tree {
       value(value)
     {}
 
+    Entry(key_type&& key, mapped_type&& value) :
+      key(std::move(key)),
+      value(std::move(value))
+    {}
+
     const key_type key;
     const mapped_type value;
   };
 
-  struct Node : std::enable_shared_from_this<const Node> {
+  struct Node : std::enable_shared_from_this<const Node>, prefix_type {
    public:
     Node(const bool red,
         const entry_ptr_type& entry,
         const node_ptr_type& left,
         const node_ptr_type& right) :
+      prefix_type(entry->key),
       red(red),
       entry(entry),
       left(left),
       right(right)
-    {}
+    {
+      TreeStats::inc(TreeStats::NODES_ALLOCATED);
+    }
+
+    // shares the entry (and key prefix) of src
+    Node(const bool red,
+        const Node& src,
+        const node_ptr_type& left,
+        const node_ptr_type& right) :
+      prefix_type(src),
+      red(red),
+      entry(src.entry),
+      left(left),
+      right(right)
+    {
+      TreeStats::inc(TreeStats::NODES_ALLOCATED);
+    }
 
     Node(const bool red, const key_type& key, const mapped_type& value) :
+      prefix_type(key),
       red(red),
       entry(std::make_shared<const Entry>(key, value))
-    {}
+    {
+      TreeStats::inc(TreeStats::NODES_ALLOCATED);
+    }
+
+    ~Node() {
+      TreeStats::inc(TreeStats::NODES_FREED);
+    }
 
    public:
     inline auto copyWithEntry(const key_type& key,
@@ -62,27 +337,44 @@ class Tree {
     }
 
     inline auto copyWithLeft(const node_ptr_type& left) const {
-      return std::make_shared<const Node>(red, entry, left, right);
+      return std::make_shared<const Node>(red, *this, left, right);
     }
 
     inline auto copyWithRight(const node_ptr_type& right) const {
-      return std::make_shared<const Node>(red, entry, left, right);
+      return std::make_shared<const Node>(red, *this, left, right);
     }
 
     inline auto copyAsBlack() const {
-      return std::make_shared<const Node>(false, entry, left, right);
+      return std::make_shared<const Node>(false, *this, left, right);
     }
 
     inline auto copyAsRed() const {
-      return std::make_shared<const Node>(true, entry, left, right);
+      return std::make_shared<const Node>(true, *this, left, right);
+    }
+
+    // <0, 0, >0 as key orders before, equal to, or after this node's key
+    inline int compare(const prefix_type& prefix, const key_type& key) const {
+      const int cmp = prefix.compare(*this);
+      if (cmp != 0) {
+        return cmp;
+      } else if (key < entry->key) {
+        return -1;
+      } else if (key > entry->key) {
+        return 1;
+      } else {
+        return 0;
+      }
     }
 
    public:
     static std::pair<node_ptr_type, bool> insert(const node_ptr_type& node,
-        const key_type& key, const mapped_type& value) {
+        const prefix_type& prefix, const key_type& key,
+        const mapped_type& value) {
       if (node) {
-        if (key < node->entry->key) {
-          const auto [new_left, is_new_key] = insert(node->left, key, value);
+        const int cmp = node->compare(prefix, key);
+        if (cmp < 0) {
+          const auto [new_left, is_new_key] =
+            insert(node->left, prefix, key, value);
           const auto new_node = node->copyWithLeft(new_left);
           if (is_new_key) {
             return std::make_pair(new_node->balance(), is_new_key);
@@ -90,8 +382,9 @@ class Tree {
             return std::make_pair(new_node, is_new_key);
           }
 
-        } else if (key > node->entry->key) {
-          const auto [new_right, is_new_key] = insert(node->right, key, value);
+        } else if (cmp > 0) {
+          const auto [new_right, is_new_key] =
+            insert(node->right, prefix, key, value);
           const auto new_node = node->copyWithRight(new_right);
           if (is_new_key) {
             return std::make_pair(new_node->balance(), is_new_key);
@@ -115,41 +408,43 @@ class Tree {
         if (left && left->red) {
           // case: (Some(R), Some(R), ..)
           if (left->left && left->left->red) {
+            TreeStats::inc(TreeStats::BALANCE_LL);
             const auto new_left = std::make_shared<Node>(
                 false,
-                left->left->entry,
+                *left->left,
                 left->left->left,
                 left->left->right);
 
             const auto new_right = std::make_shared<Node>(
                 false,
-                entry,
+                *this,
                 left->right,
                 right);
 
             return std::make_shared<const Node>(
                 true,
-                left->entry,
+                *left,
                 new_left,
                 new_right);
 
             // case: (Some(R), _, Some(R), ..)
           } else if (left->right && left->right->red) {
+            TreeStats::inc(TreeStats::BALANCE_LR);
             const auto new_left = std::make_shared<Node>(
                 false,
-                left->entry,
+                *left,
                 left->left,
                 left->right->left);
 
             const auto new_right = std::make_shared<Node>(
                 false,
-                entry,
+                *this,
                 left->right->right,
                 right);
 
             return std::make_shared<const Node>(
                 true,
-                left->right->entry,
+                *left->right,
                 new_left,
                 new_right);
           }
@@ -158,41 +453,43 @@ class Tree {
         // case: (.., Some(R), Some(R), _)
         if (right && right->red) {
           if (right->left && right->left->red) {
+            TreeStats::inc(TreeStats::BALANCE_RL);
             const auto new_left = std::make_shared<Node>(
                 false,
-                entry,
+                *this,
                 left,
                 right->left->left);
 
             const auto new_right = std::make_shared<Node>(
                 false,
-                right->entry,
+                *right,
                 right->left->right,
                 right->right);
 
             return std::make_shared<const Node>(
                 true,
-                right->left->entry,
+                *right->left,
                 new_left,
                 new_right);
 
             // case: (.., Some(R), _, Some(R))
           } else if (right->right && right->right->red) {
+            TreeStats::inc(TreeStats::BALANCE_RR);
             const auto new_left = std::make_shared<Node>(
                 false,
-                entry,
+                *this,
                 left,
                 right->left);
 
             const auto new_right = std::make_shared<Node>(
                 false,
-                right->right->entry,
+                *right->right,
                 right->right->left,
                 right->right->right);
 
             return std::make_shared<const Node>(
                 true,
-                right->entry,
+                *right,
                 new_left,
                 new_right);
           }
@@ -221,6 +518,10 @@ class Tree {
         return 0; // LCOV_EXCL_LINE
       }
 
+      if (prefix_type(node->entry->key).compare(*node) != 0) {
+        return 0; // LCOV_EXCL_LINE
+      }
+
       const auto lh = checkConsistency(left);
       const auto rh = checkConsistency(right);
 
@@ -254,87 +555,91 @@ class Tree {
       // match: (left.color, right.color)
       // case: (B, R)
       if (!left->red && right->red) {
+        TreeStats::inc(TreeStats::FUSE_BR);
         return std::make_shared<const Node>(
             true,
-            right->entry,
+            *right,
             fuse(left, right->left),
             right->right);
 
         // case: (R, B)
       } else if (left->red && !right->red) {
+        TreeStats::inc(TreeStats::FUSE_RB);
         return std::make_shared<const Node>(
             true,
-            left->entry,
+            *left,
             left->left,
             fuse(left->right, right));
 
         // case: (R, R)
       } else if (left->red && right->red) {
+        TreeStats::inc(TreeStats::FUSE_RR);
         const auto fused = fuse(left->right, right->left);
         if (fused && fused->red) {
           const auto new_left = std::make_shared<const Node>(
               true,
-              left->entry,
+              *left,
               left->left,
               fused->left);
 
           const auto new_right = std::make_shared<const Node>(
               true,
-              right->entry,
+              *right,
               fused->right,
               right->right);
 
           return std::make_shared<const Node>(
               true,
-              fused->entry,
+              *fused,
               new_left,
               new_right);
         }
 
         const auto new_right = std::make_shared<const Node>(
             true,
-            right->entry,
+            *right,
             fused,
             right->right);
 
         return std::make_shared<const Node>(
             true,
-            left->entry,
+            *left,
             left->left,
             new_right);
 
         // case: (B, B)
       } else if (!left->red && !right->red) {
+        TreeStats::inc(TreeStats::FUSE_BB);
         const auto fused = fuse(left->right, right->left);
         if (fused && fused->red) {
           const auto new_left = std::make_shared<const Node>(
               false,
-              left->entry,
+              *left,
               left->left,
               fused->left);
 
           const auto new_right = std::make_shared<const Node>(
               false,
-              right->entry,
+              *right,
               fused->right,
               right->right);
 
           return std::make_shared<const Node>(
               true,
-              fused->entry,
+              *fused,
               new_left,
               new_right);
         }
 
         const auto new_right = std::make_shared<const Node>(
             false,
-            right->entry,
+            *right,
             fused,
             right->right);
 
         const auto new_node = std::make_shared<const Node>(
             true,
-            left->entry,
+            *left,
             left->left,
             new_right);
 
@@ -356,7 +661,7 @@ class Tree {
 
         return std::make_shared<const Node>(
             true,
-            node->entry,
+            *node,
             new_left,
             new_right);
       }
@@ -371,13 +676,13 @@ class Tree {
       if (node->left && node->left->red) {
         const auto new_left = std::make_shared<const Node>(
             false,
-            node->left->entry,
+            *node->left,
             node->left->left,
             node->left->right);
 
         return std::make_shared<const Node>(
             true,
-            node->entry,
+            *node,
             new_left,
             node->right);
 
@@ -385,13 +690,13 @@ class Tree {
       } else if (node->right && !node->right->red) {
         const auto new_right = std::make_shared<const Node>(
             true,
-            node->right->entry,
+            *node->right,
             node->right->left,
             node->right->right);
 
         const auto new_node = std::make_shared<const Node>(
             false,
-            node->entry,
+            *node,
             node->left,
             new_right);
 
@@ -403,7 +708,7 @@ class Tree {
 
         const auto unbalanced_new_right = std::make_shared<const Node>(
             false,
-            node->right->entry,
+            *node->right,
             node->right->left->right,
             node->right->right->copyAsRed());
 
@@ -411,13 +716,13 @@ class Tree {
 
         const auto new_left = std::make_shared<const Node>(
             false,
-            node->entry,
+            *node,
             node->left,
             node->right->left->left);
 
         return std::make_shared<const Node>(
             true,
-            node->right->left->entry,
+            *node->right->left,
             new_left,
             new_right);
       }
@@ -431,13 +736,13 @@ class Tree {
       if (node->right && node->right->red) {
         const auto new_right = std::make_shared<const Node>(
             false,
-            node->right->entry,
+            *node->right,
             node->right->left,
             node->right->right);
 
         return std::make_shared<const Node>(
             true,
-            node->entry,
+            *node,
             node->left,
             new_right);
 
@@ -445,13 +750,13 @@ class Tree {
       } else if (node->left && !node->left->red) {
         const auto new_left = std::make_shared<const Node>(
             true,
-            node->left->entry,
+            *node->left,
             node->left->left,
             node->left->right);
 
         const auto new_node = std::make_shared<const Node>(
             false,
-            node->entry,
+            *node,
             new_left,
             node->right);
 
@@ -463,7 +768,7 @@ class Tree {
 
         const auto unbalanced_new_left = std::make_shared<const Node>(
             false,
-            node->left->entry,
+            *node->left,
             node->left->left->copyAsRed(),
             node->left->right->left);
 
@@ -471,13 +776,13 @@ class Tree {
 
         const auto new_right = std::make_shared<const Node>(
             false,
-            node->entry,
+            *node,
             node->left->right->right,
             node->right);
 
         return std::make_shared<const Node>(
             true,
-            node->left->right->entry,
+            *node->left->right,
             new_left,
             new_right);
       }
@@ -486,12 +791,13 @@ class Tree {
     }
 
     static std::pair<node_ptr_type, bool> remove_left(
-        const node_ptr_type& node, const key_type& key) {
-      const auto [new_left, removed] = remove(node->left, key);
+        const node_ptr_type& node, const prefix_type& prefix,
+        const key_type& key) {
+      const auto [new_left, removed] = remove(node->left, prefix, key);
 
       const auto new_node = std::make_shared<const Node>(
           true, // In case of rebalance the color does not matter
-          node->entry,
+          *node,
           new_left,
           node->right);
 
@@ -503,12 +809,13 @@ class Tree {
     }
 
     static std::pair<node_ptr_type, bool> remove_right(
-        const node_ptr_type& node, const key_type& key) {
-      const auto [new_right, removed] = remove(node->right, key);
+        const node_ptr_type& node, const prefix_type& prefix,
+        const key_type& key) {
+      const auto [new_right, removed] = remove(node->right, prefix, key);
 
       const auto new_node = std::make_shared<const Node>(
           true, // In case of rebalance the color does not matter
-          node->entry,
+          *node,
           node->left,
           new_right);
 
@@ -520,12 +827,14 @@ class Tree {
     }
 
     static std::pair<node_ptr_type, bool> remove(
-        const node_ptr_type& node, const key_type& key) {
+        const node_ptr_type& node, const prefix_type& prefix,
+        const key_type& key) {
       if (node) {
-        if (key < node->entry->key) {
-          return remove_left(node, key);
-        } else if (key > node->entry->key) {
-          return remove_right(node, key);
+        const int cmp = node->compare(prefix, key);
+        if (cmp < 0) {
+          return remove_left(node, prefix, key);
+        } else if (cmp > 0) {
+          return remove_right(node, prefix, key);
         } else {
           const auto new_node = fuse(node->left, node->right);
           return std::make_pair(new_node, true);
@@ -542,6 +851,63 @@ class Tree {
     const node_ptr_type right;
   };
 
+ public:
+  /*
+   * A batch of updates applied to a private version of a base snapshot. The
+   * transaction is published with AtomicTree::commit, which three-way merges
+   * the private version with whatever was published after the base.
+   */
+  class Transaction {
+   public:
+    explicit Transaction(const Tree& base) :
+      base_(base),
+      tree_(base)
+    {}
+
+    void insert(const key_type& key, const mapped_type& value) {
+      tree_ = tree_.insert(key, value);
+    }
+
+    void remove(const key_type& key) {
+      tree_ = tree_.remove(key);
+    }
+
+    const Tree& base() const {
+      return base_;
+    }
+
+    const Tree& tree() const {
+      return tree_;
+    }
+
+   private:
+    Tree base_;
+    Tree tree_;
+  };
+
+  /*
+   * Conflict policies for merge(). A policy is invoked for each key changed by
+   * both sides with the base, ours and theirs values (boost::none when the key
+   * is absent) and returns the merged value, or boost::none to remove the key.
+   */
+  struct PreferOurs {
+    boost::optional<mapped_type> operator()(const key_type&,
+        const boost::optional<mapped_type>&,
+        const boost::optional<mapped_type>& ours,
+        const boost::optional<mapped_type>&) const {
+      return ours;
+    }
+  };
+
+  struct PreferTheirs {
+    boost::optional<mapped_type> operator()(const key_type&,
+        const boost::optional<mapped_type>&,
+        const boost::optional<mapped_type>&,
+        const boost::optional<mapped_type>& theirs) const {
+      return theirs;
+    }
+  };
+
  public:
   Tree() :
     root_(nullptr),
@@ -555,14 +921,21 @@ class Tree {
 
  public:
   Tree insert(const key_type& key, const mapped_type& value) const {
-    const auto [mb_new_root, is_new_key] = Node::insert(root_, key, value);
+    const TreeStats::Scope stats(TreeStats::INSERTS,
+        TreeStats::INSERT_NODES_ALLOCATED);
+    const prefix_type prefix(key);
+    const auto [mb_new_root, is_new_key] =
+      Node::insert(root_, prefix, key, value);
     const auto new_root = mb_new_root->copyAsBlack(); // mb = maybe black
     const auto new_size = size_ + (is_new_key ? 1 : 0);
     return Tree(new_root, new_size);
   }
 
   Tree remove(const key_type& key) const {
-    const auto [mb_new_root, removed] = Node::remove(root_, key);
+    const TreeStats::Scope stats(TreeStats::REMOVES,
+        TreeStats::REMOVE_NODES_ALLOCATED);
+    const prefix_type prefix(key);
+    const auto [mb_new_root, removed] = Node::remove(root_, prefix, key);
     if (removed) {
       const auto new_root = mb_new_root ?
         mb_new_root->copyAsBlack() : mb_new_root;
@@ -572,13 +945,56 @@ class Tree {
     }
   }
 
+  /*
+   * Build a tree from unsorted (key, value) pairs using up to the given number
+   * of threads. When a key appears more than once the last value wins. The
+   * input is sorted in parallel, and the balanced tree is assembled from
+   * independent subtrees built concurrently under the top levels. Each
+   * thread gets at least build_grain items, so small inputs use fewer
+   * threads than requested.
+   */
+  template<typename InputIt>
+  static Tree build(InputIt first, InputIt last,
+      unsigned threads = std::thread::hardware_concurrency()) {
+    std::vector<value_type> items(first, last);
+
+    const auto max_threads = std::max<std::size_t>(1,
+        items.size() / build_grain);
+    threads = std::max(1u, static_cast<unsigned>(
+          std::min<std::size_t>(threads, max_threads)));
+
+    sortUnique(items, threads);
+    if (items.empty()) {
+      return Tree();
+    }
+
+    // split one level per doubling of threads
+    std::size_t spawn_depth = 0;
+    while ((std::size_t(1) << spawn_depth) < threads) {
+      spawn_depth++;
+    }
+
+    // levels 0 .. red_depth - 1 are full. Nodes below them form a partial
+    // last level and are colored red, so every path has red_depth black nodes.
+    std::size_t red_depth = 0;
+    while ((std::size_t(2) << red_depth) <= items.size() + 1) {
+      red_depth++;
+    }
+
+    const auto root = buildBalanced(items.data(),
+        items.data() + items.size(), 0, red_depth, spawn_depth);
+    return Tree(root, items.size());
+  }
+
   boost::optional<value_type> get(const key_type& key) const {
-    auto cur = root_;
+    const prefix_type prefix(key);
+    auto cur = root_.get();
     while (cur) {
-      if (key < cur->entry->key) {
-        cur = cur->left;
-      } else if (key > cur->entry->key) {
-        cur = cur->right;
+      const int cmp = cur->compare(prefix, key);
+      if (cmp < 0) {
+        cur = cur->left.get();
+      } else if (cmp > 0) {
+        cur = cur->right.get();
       } else {
         return std::make_pair(cur->entry->key, cur->entry->value);
       }
@@ -604,10 +1020,168 @@ class Tree {
     return out;
   }
 
+  /*
+   * Invoke f(key, value) for every entry in key order.
+   */
+  template<typename F>
+  void forEach(F&& f) const {
+    std::vector<const Node*> s;
+    auto node = root_.get();
+    while (!s.empty() || node) {
+      if (node) {
+        s.push_back(node);
+        node = node->left.get();
+      } else {
+        node = s.back();
+        s.pop_back();
+        f(node->entry->key, node->entry->value);
+        node = node->right.get();
+      }
+    }
+  }
+
+  /*
+   * Invoke f(key, value) in key order for every entry with lo <= key < hi.
+   */
+  template<typename F>
+  void forEach(const key_type& lo, const key_type& hi, F&& f) const {
+    // stack the path to the first entry not less than lo
+    std::vector<const Node*> s;
+    auto node = root_.get();
+    while (node) {
+      if (node->entry->key < lo) {
+        node = node->right.get();
+      } else {
+        s.push_back(node);
+        node = node->left.get();
+      }
+    }
+
+    while (!s.empty()) {
+      node = s.back();
+      s.pop_back();
+      if (!(node->entry->key < hi)) {
+        break;
+      }
+      f(node->entry->key, node->entry->value);
+      for (node = node->right.get(); node; node = node->left.get()) {
+        s.push_back(node);
+      }
+    }
+  }
+
+  /*
+   * Invoke f(key, from_value, to_value) for every key whose entry differs
+   * between the two versions, in key order. Subtrees shared by both versions
+   * are skipped without being visited, so the cost is proportional to the
+   * number of nodes that were copied between the versions.
+   */
+  template<typename F>
+  static void diff(const Tree& from, const Tree& to, F&& f) {
+    diffEntries(from.root_, to.root_,
+        [&](const key_type& key, const Entry *a, const Entry *b) {
+          f(key, optionalValue(a), optionalValue(b));
+        });
+  }
+
+  /*
+   * Three-way merge. The changes made by ours relative to base are replayed
+   * onto theirs. A key that theirs also changed relative to base is resolved
+   * by the conflict policy.
+   */
+  template<typename Policy>
+  static Tree merge(const Tree& base, const Tree& ours, const Tree& theirs,
+      Policy&& policy) {
+    if (base.root_ == theirs.root_) {
+      return ours;
+    } else if (base.root_ == ours.root_) {
+      return theirs;
+    }
+
+    Tree out = theirs;
+    diffEntries(base.root_, ours.root_,
+        [&](const key_type& key, const Entry *b, const Entry *o) {
+          const auto t = theirs.find(key);
+          if (t == b) {
+            out = o ? out.insert(key, o->value) : out.remove(key);
+          } else {
+            const auto value = policy(key, optionalValue(b),
+                optionalValue(o), optionalValue(t));
+            out = value ? out.insert(key, *value) : out.remove(key);
+          }
+        });
+    return out;
+  }
+
   auto size() const {
     return size_;
   }
 
+  // number of nodes on the longest path from the root to a leaf
+  std::size_t height() const {
+    std::size_t height = 0;
+    std::vector<std::pair<const Node*, std::size_t>> s;
+    if (root_) {
+      s.emplace_back(root_.get(), 1);
+    }
+    while (!s.empty()) {
+      const auto [node, depth] = s.back();
+      s.pop_back();
+      height = std::max(height, depth);
+      if (node->left) {
+        s.emplace_back(node->left.get(), depth + 1);
+      }
+      if (node->right) {
+        s.emplace_back(node->right.get(), depth + 1);
+      }
+    }
+    return height;
+  }
+
+  // number of black nodes on every path from the root to a leaf
+  std::size_t blackHeight() const {
+    std::size_t height = 0;
+    for (auto node = root_.get(); node; node = node->left.get()) {
+      height += node->red ? 0 : 1;
+    }
+    return height;
+  }
+
+  struct Sharing {
+    std::size_t unique; // nodes reachable only from this version
+    std::size_t shared; // nodes also reachable from the other version
+  };
+
+  /*
+   * Count the nodes of this version that are shared with another version. A
+   * node can only be reachable in the other version on the search path for
+   * its key, so each node is checked with one lookup. Every node below a
+   * shared node is shared, so the walk only visits unique nodes and costs
+   * O(unique * log n).
+   */
+  Sharing sharing(const Tree& other) const {
+    std::size_t unique = 0;
+    std::vector<const Node*> s;
+    if (root_) {
+      s.push_back(root_.get());
+    }
+    while (!s.empty()) {
+      const auto node = s.back();
+      s.pop_back();
+      if (other.findNode(node->entry->key) == node) {
+        continue;
+      }
+      unique++;
+      if (node->left) {
+        s.push_back(node->left.get());
+      }
+      if (node->right) {
+        s.push_back(node->right.get());
+      }
+    }
+    return Sharing{unique, size_ - unique};
+  }
+
   bool consistent() const {
     if (root_) {
       return Node::checkConsistency(root_) != 0;
@@ -618,9 +1192,297 @@ class Tree {
 
   void clear() {
     root_.reset();
+    size_ = 0;
+  }
+
+ private:
+  /*
+   * Stable sort by key in parallel, then keep the last of each run of equal
+   * keys. Sorted chunks are merged pairwise with stable merges so that equal
+   * keys stay in input order.
+   */
+  static void sortUnique(std::vector<value_type>& items, unsigned threads) {
+    const auto less = [](const value_type& a, const value_type& b) {
+      return a.first < b.first;
+    };
+
+    const auto n = items.size();
+    const auto begin = items.begin();
+    std::size_t width = (n + threads - 1) / threads;
+
+    std::vector<std::thread> workers;
+    for (std::size_t i = 0; i < n; i += width) {
+      const auto end = std::min(i + width, n);
+      workers.emplace_back([=] {
+        std::stable_sort(begin + i, begin + end, less);
+      });
+    }
+    for (auto& worker : workers) {
+      worker.join();
+    }
+
+    for (; width < n; width *= 2) {
+      workers.clear();
+      for (std::size_t i = 0; i + width < n; i += 2 * width) {
+        const auto end = std::min(i + 2 * width, n);
+        workers.emplace_back([=] {
+          std::inplace_merge(begin + i, begin + i + width, begin + end, less);
+        });
+      }
+      for (auto& worker : workers) {
+        worker.join();
+      }
+    }
+
+    std::size_t unique = 0;
+    for (std::size_t i = 0; i < n; i++) {
+      if (i + 1 < n && !less(items[i], items[i + 1])) {
+        continue; // a later value for the same key wins
+      }
+      if (unique != i) {
+        items[unique] = std::move(items[i]);
+      }
+      unique++;
+    }
+    items.erase(items.begin() + unique, items.end());
+  }
+
+  static constexpr std::size_t build_grain = 1 << 16;
+
+  // moves the keys and values out of [first, last) into the new nodes
+  static node_ptr_type buildBalanced(value_type *first,
+      value_type *last, const std::size_t depth,
+      const std::size_t red_depth, const std::size_t spawn_depth) {
+    if (first == last) {
+      return nullptr;
+    }
+
+    const auto mid = first + (last - first) / 2;
+    node_ptr_type left;
+    node_ptr_type right;
+    if (depth < spawn_depth) {
+      auto left_future = std::async(std::launch::async, [=] {
+        return buildBalanced(first, mid, depth + 1, red_depth, spawn_depth);
+      });
+      right = buildBalanced(mid + 1, last, depth + 1, red_depth, spawn_depth);
+      left = left_future.get();
+    } else {
+      left = buildBalanced(first, mid, depth + 1, red_depth, spawn_depth);
+      right = buildBalanced(mid + 1, last, depth + 1, red_depth, spawn_depth);
+    }
+
+    const auto entry = std::make_shared<const Entry>(std::move(mid->first),
+        std::move(mid->second));
+    return std::make_shared<const Node>(depth >= red_depth, entry, left,
+        right);
+  }
+
+  const Node *findNode(const key_type& key) const {
+    const prefix_type prefix(key);
+    auto cur = root_.get();
+    while (cur) {
+      const int cmp = cur->compare(prefix, key);
+      if (cmp < 0) {
+        cur = cur->left.get();
+      } else if (cmp > 0) {
+        cur = cur->right.get();
+      } else {
+        return cur;
+      }
+    }
+    return nullptr;
+  }
+
+  const Entry *find(const key_type& key) const {
+    const auto node = findNode(key);
+    return node ? node->entry.get() : nullptr;
+  }
+
+  static boost::optional<mapped_type> optionalValue(const Entry *entry) {
+    if (entry) {
+      return entry->value;
+    } else {
+      return boost::none;
+    }
+  }
+
+  /*
+   * In-order cursor whose pending items are either whole subtrees or single
+   * entries. A pending subtree can be skipped or expanded into its left
+   * subtree, its entry and its right subtree.
+   */
+  class Cursor {
+   public:
+    explicit Cursor(const Node *root) {
+      push(root);
+    }
+
+    bool done() const {
+      return frames_.empty();
+    }
+
+    bool atSubtree() const {
+      return !frames_.back().second;
+    }
+
+    const Node *top() const {
+      return frames_.back().first;
+    }
+
+    void expand() {
+      const auto node = top();
+      frames_.pop_back();
+      push(node->right.get());
+      frames_.emplace_back(node, true);
+      push(node->left.get());
+    }
+
+    void skip() {
+      frames_.pop_back();
+    }
+
+   private:
+    void push(const Node *node) {
+      if (node) {
+        frames_.emplace_back(node, false);
+      }
+    }
+
+    std::vector<std::pair<const Node*, bool>> frames_;
+  };
+
+  template<typename F>
+  static void diffEntries(const node_ptr_type& from, const node_ptr_type& to,
+      F&& f) {
+    Cursor a(from.get());
+    Cursor b(to.get());
+
+    while (!a.done() && !b.done()) {
+      if (a.atSubtree() && b.atSubtree()) {
+        if (a.top() == b.top()) {
+          a.skip();
+          b.skip();
+          continue;
+        }
+        // expand the subtree more likely to contain the other one
+        const auto& a_key = a.top()->entry->key;
+        const auto& b_key = b.top()->entry->key;
+        if (a_key < b_key) {
+          b.expand();
+        } else if (b_key < a_key) {
+          a.expand();
+        } else {
+          a.expand();
+          b.expand();
+        }
+
+      } else if (a.atSubtree()) {
+        a.expand();
+
+      } else if (b.atSubtree()) {
+        b.expand();
+
+      } else {
+        const auto a_entry = a.top()->entry.get();
+        const auto b_entry = b.top()->entry.get();
+        if (a_entry->key < b_entry->key) {
+          f(a_entry->key, a_entry, nullptr);
+          a.skip();
+        } else if (b_entry->key < a_entry->key) {
+          f(b_entry->key, nullptr, b_entry);
+          b.skip();
+        } else {
+          if (a_entry != b_entry) {
+            f(a_entry->key, a_entry, b_entry);
+          }
+          a.skip();
+          b.skip();
+        }
+      }
+    }
+
+    while (!a.done()) {
+      if (a.atSubtree()) {
+        a.expand();
+      } else {
+        f(a.top()->entry->key, a.top()->entry.get(), nullptr);
+        a.skip();
+      }
+    }
+
+    while (!b.done()) {
+      if (b.atSubtree()) {
+        b.expand();
+      } else {
+        f(b.top()->entry->key, nullptr, b.top()->entry.get());
+        b.skip();
+      }
+    }
   }
 
  private:
   node_ptr_type root_;
   std::size_t size_;
 };
+
+/*
+ * A published tree version shared by multiple writers. Writers begin a
+ * transaction from the current version, apply updates privately, and commit
+ * by merging with versions published in the meantime. Writers that touch
+ * disjoint keys never conflict, and commit in time proportional to the size
+ * of their transaction rather than serializing on a lock for the batch.
+ */
+template<
+  typename Key,
+  typename T>
+class AtomicTree {
+ public:
+  typedef Tree<Key, T> tree_type;
+  typedef typename tree_type::Transaction transaction_type;
+
+  AtomicTree() :
+    head_(std::make_shared<const tree_type>())
+  {}
+
+  explicit AtomicTree(const tree_type& tree) :
+    head_(std::make_shared<const tree_type>(tree))
+  {}
+
+ public:
+  tree_type load() const {
+    return *std::atomic_load(&head_);
+  }
+
+  void store(const tree_type& tree) {
+    std::atomic_store(&head_, std::make_shared<const tree_type>(tree));
+  }
+
+  transaction_type begin() const {
+    return transaction_type(load());
+  }
+
+  /*
+   * Publish the transaction and return the published version. If another
+   * writer wins the race the merged result is rebased onto its version and
+   * the commit is retried.
+   */
+  template<typename Policy = typename tree_type::PreferOurs>
+  tree_type commit(const transaction_type& txn, Policy policy = Policy()) {
+    auto base = txn.base();
+    auto ours = txn.tree();
+    auto cur = std::atomic_load(&head_);
+    while (true) {
+      const auto seen = cur;
+      const auto merged = tree_type::merge(base, ours, *seen, policy);
+      const auto next = std::make_shared<const tree_type>(merged);
+      if (std::atomic_compare_exchange_weak(&head_, &cur, next)) {
+        return merged;
+      }
+      base = *seen;
+      ours = merged;
+    }
+  }
+
+ private:
+  std::shared_ptr<const tree_type> head_;
+};